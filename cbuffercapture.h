@@ -0,0 +1,206 @@
+#pragma once
+// Capture of cbuffer updates to a memory mapped file, for offline replay with cbufferreplay.cpp
+//
+// Define CBUFFERGEN_CAPTURE before including the generated .cpp.h files to give each _cb struct a CAPTURE_ID and CAPTURE_NAME.
+// Then open a capture file once, and call CBUFFER_CAPTURE(frame, cb) wherever a _cb struct is written:
+//
+//		CBufferCaptureOpen("frames.cbcap", 1024 * 1024 * 1024);
+//		...
+//		CBUFFER_CAPTURE(frame_index, draw_cb);
+//		...
+//		CBufferCaptureClose();
+//
+// Without CBUFFERGEN_CAPTURE, CBUFFER_CAPTURE compiles to nothing.
+// Writing is lock free; when the file is full, further records are dropped and counted in the header.
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#define CBUFFER_CAPTURE_MAGIC 0x50414342 // "BCAP"
+#define CBUFFER_CAPTURE_VERSION 1
+#define CBUFFER_CAPTURE_NAME_FRAME 0xffffffff // records with this frame carry the struct name as payload
+#define CBUFFER_CAPTURE_ALIGN 16
+
+struct CBufferCaptureHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;					// bytes available for records after the header
+	std::atomic<uint64_t> used;			// bytes of records written
+	std::atomic<uint64_t> dropped;		// records that did not fit
+};
+
+struct CBufferCaptureRecord
+{
+	uint32_t id;
+	uint32_t frame;
+	uint32_t size;						// payload size, payload is padded to CBUFFER_CAPTURE_ALIGN
+	uint32_t reserved;
+};
+static_assert(sizeof(CBufferCaptureHeader) % CBUFFER_CAPTURE_ALIGN == 0, "");
+static_assert(sizeof(CBufferCaptureRecord) == CBUFFER_CAPTURE_ALIGN, "");
+
+inline uint64_t CBufferCaptureRecordSize(uint32_t payload_size)
+{
+	return sizeof(CBufferCaptureRecord) + ((payload_size + CBUFFER_CAPTURE_ALIGN - 1) & ~(uint64_t)(CBUFFER_CAPTURE_ALIGN - 1));
+}
+
+#ifdef CBUFFERGEN_CAPTURE
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <new>
+
+struct CBufferCaptureState
+{
+	CBufferCaptureHeader* header = nullptr;
+	char* data = nullptr;
+	uint64_t mapped_size = 0;
+	std::atomic<uint32_t> generation{0};	// bumped by every open, name records are written once per generation
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+inline CBufferCaptureState& CBufferCaptureGet()
+{
+	static CBufferCaptureState state;
+	return state;
+}
+
+inline bool CBufferCaptureOpen(const char* path, uint64_t capacity)
+{
+	CBufferCaptureState& S = CBufferCaptureGet();
+	if(S.header)
+		return false;
+	uint64_t mapped_size = sizeof(CBufferCaptureHeader) + capacity;
+	void* ptr = nullptr;
+#ifdef _WIN32
+	S.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(S.file == INVALID_HANDLE_VALUE)
+		return false;
+	S.mapping = CreateFileMappingA(S.file, nullptr, PAGE_READWRITE, (DWORD)(mapped_size >> 32), (DWORD)mapped_size, nullptr);
+	if(S.mapping)
+		ptr = MapViewOfFile(S.mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)mapped_size);
+	if(!ptr)
+	{
+		if(S.mapping)
+			CloseHandle(S.mapping);
+		CloseHandle(S.file);
+		S.mapping = nullptr;
+		S.file = INVALID_HANDLE_VALUE;
+		return false;
+	}
+#else
+	S.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(S.fd < 0)
+		return false;
+	if(0 == ftruncate(S.fd, (off_t)mapped_size))
+		ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, S.fd, 0);
+	if(!ptr || ptr == MAP_FAILED)
+	{
+		close(S.fd);
+		S.fd = -1;
+		return false;
+	}
+#endif
+	CBufferCaptureHeader* header = new (ptr) CBufferCaptureHeader;
+	header->magic = CBUFFER_CAPTURE_MAGIC;
+	header->version = CBUFFER_CAPTURE_VERSION;
+	header->capacity = capacity;
+	header->used.store(0);
+	header->dropped.store(0);
+	S.data = (char*)ptr + sizeof(CBufferCaptureHeader);
+	S.mapped_size = mapped_size;
+	S.header = header;
+	S.generation.fetch_add(1);
+	return true;
+}
+
+// unmaps and truncates the file to the records written. no writes may be in flight.
+inline void CBufferCaptureClose()
+{
+	CBufferCaptureState& S = CBufferCaptureGet();
+	if(!S.header)
+		return;
+	uint64_t file_size = sizeof(CBufferCaptureHeader) + S.header->used.load();
+#ifdef _WIN32
+	UnmapViewOfFile(S.header);
+	CloseHandle(S.mapping);
+	LARGE_INTEGER pos;
+	pos.QuadPart = (LONGLONG)file_size;
+	SetFilePointerEx(S.file, pos, nullptr, FILE_BEGIN);
+	SetEndOfFile(S.file);
+	CloseHandle(S.file);
+	S.mapping = nullptr;
+	S.file = INVALID_HANDLE_VALUE;
+#else
+	munmap(S.header, S.mapped_size);
+	if(0 != ftruncate(S.fd, (off_t)file_size))
+	{
+		//keep the full file, the reader stops at header->used
+	}
+	close(S.fd);
+	S.fd = -1;
+#endif
+	S.header = nullptr;
+	S.data = nullptr;
+}
+
+// returns false when no capture is open or the record did not fit
+inline bool CBufferCaptureWrite(uint32_t id, uint32_t frame, const void* payload, uint32_t size)
+{
+	CBufferCaptureState& S = CBufferCaptureGet();
+	CBufferCaptureHeader* header = S.header;
+	if(!header)
+		return false;
+	uint64_t record_size = CBufferCaptureRecordSize(size);
+	uint64_t offset = header->used.load();
+	do
+	{
+		if(offset + record_size > header->capacity)
+		{
+			header->dropped.fetch_add(1);
+			return false;
+		}
+	}while(!header->used.compare_exchange_weak(offset, offset + record_size));
+	CBufferCaptureRecord* record = (CBufferCaptureRecord*)(S.data + offset);
+	record->id = id;
+	record->frame = frame;
+	record->size = size;
+	record->reserved = 0;
+	memcpy(record + 1, payload, size);
+	return true;
+}
+
+template<typename T>
+void CBufferCaptureStruct(uint32_t frame, const T& cb)
+{
+	// generation the name record was written for. reset when the write fails, so it is retried
+	static std::atomic<uint32_t> named_generation{0};
+	uint32_t generation = CBufferCaptureGet().generation.load();
+	uint32_t named = named_generation.load();
+	if(named != generation && named_generation.compare_exchange_strong(named, generation))
+	{
+		if(!CBufferCaptureWrite(T::CAPTURE_ID, CBUFFER_CAPTURE_NAME_FRAME, T::CAPTURE_NAME, (uint32_t)strlen(T::CAPTURE_NAME)))
+			named_generation.store(named);
+	}
+	CBufferCaptureWrite(T::CAPTURE_ID, frame, &cb, (uint32_t)sizeof(T));
+}
+
+#define CBUFFER_CAPTURE(frame, cb) CBufferCaptureStruct(frame, cb)
+#else
+#define CBUFFER_CAPTURE(frame, cb) do{}while(0)
+#endif
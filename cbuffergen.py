@@ -8,6 +8,7 @@ import shlex
 import json
 import argparse
 import math
+import bisect
 
 from io import StringIO
 from enum import Enum
@@ -16,6 +17,7 @@ from enum import Enum
 #  size calcs are in dwords, so no support for double, uint16_t
 
 DELAYED_STRUCT_SIZE = -42
+MAX_PACKED_ENUM_BITS = 8
 class TypeClass(Enum):
 	BUILTIN = 1
 	TYPEDEF = 2
@@ -26,6 +28,9 @@ Typedefs = {
 	"PalDescriptorHandle":4
 }
 
+# headers shipped with cbuffergen, never treated as input
+SupportFiles = ["hlsltypes.h", "cbuffercapture.h", "cbufferlayout.h"]
+
 for t in Typedefs:
 	assert (Typedefs[t] % 4) == 0
 
@@ -37,12 +42,35 @@ def GetArraySize(size, array_size):
 	total_size = (array_size-1) * GetAlignedArrayElementSize(size) + size
 	return int(total_size)
 
+def CaptureId(name):
+	# 32 bit FNV-1a, must stay stable as it identifies structs in capture files
+	h = 0x811c9dc5
+	for c in name.encode():
+		h = ((h ^ c) * 0x01000193) & 0xffffffff
+	return h
+
+# whitespace, comments and preprocessor lines are matched as the prefix of the next token, so every match is a token.
+# the empty eof token ends the file, so the prefix never has to backtrack.
+# plain members (type name[N];) are the bulk of large headers and are matched as one token, see MEMBER_PATTERN
+TOKEN_PATTERN = re.compile(r'''
+	(?:\s+|//[^\n]*|/\*.*?\*/|\#(?:\\\n|[^\n])*)*
+	(?:(?P<member>[A-Za-z_]\w*\s+[A-Za-z_]\w*\s*(?:\[\s*\w+\s*\]\s*)?;)
+	|(?P<string>"(?:\\.|[^"\\\n])*"|'(?:\\.|[^'\\\n])*')
+	|(?P<unterminated>/\*.*)
+	|(?P<ident>[A-Za-z_]\w*)
+	|(?P<number>\d\w*)
+	|(?P<punct>.)
+	|(?P<eof>\Z))''', re.VERBOSE | re.DOTALL)
+# splits a member token into type, name and array size
+MEMBER_PATTERN = re.compile(r'(\w+)\s+(\w+)\s*(?:\[\s*(\w+)\s*\]\s*)?;')
+
 class Line:
 	def __init__(L, G, type, name, array_size, array_ext):
 		L.G = G
 		L.type = type
 		L.name = name
 		L.array_size = array_size
+		L.packed_fields = []
 		if array_size:
 			L.array_ext = f"[{array_ext}]"
 			L.array_ext_cb = f"{array_ext}";
@@ -109,10 +137,12 @@ class Line:
 				L.cb_size = L.hlsl_size
 
 			L.hlsl_type = f"{L.hlsl_base_type}"
+			# enums are stored as 32 bit regardless of their underlying type
+			cb_base_type = "hlsl_uint" if type in G.enums else L.hlsl_base_type
 			if L.array_size:
-				L.hlsl_cb_type = f"hlsl_any_array_cb<{L.hlsl_base_type}, {L.array_size}>"
+				L.hlsl_cb_type = f"hlsl_any_array_cb<{cb_base_type}, {L.array_size}>"
 			else:
-				L.hlsl_cb_type = L.hlsl_base_type
+				L.hlsl_cb_type = cb_base_type
 
 		else:
 			print(f"unknown typeclass {L.type_class}")
@@ -124,13 +154,21 @@ class Line:
 class CBufferGenStruct:
 	def __init__(A):
 		A.dependencies = set()
-		A.parse_state = 0
 
 class CBufferGenFile:
-	def __init__(A):
+	def __init__(A, name, content):
+		A.name = name
+		A.content = content
+		A.newlines = None
 		A.structs = {}
 		A.struct_order = []
 
+	def LineAt(A, pos):
+		# line numbers are only needed for diagnostics, so newlines are indexed on first use
+		if A.newlines is None:
+			A.newlines = [match.start() for match in re.finditer("\n", A.content)]
+		return bisect.bisect_left(A.newlines, pos) + 1
+
 
 class CBufferGen:
 	def __init__(A):
@@ -139,35 +177,97 @@ class CBufferGen:
 		A.parser.add_argument("-i", "--input_path", help="input directory", default=".")
 		A.parser.add_argument("-c", "--c_path", help="directory for generated header c file", default=".")
 		A.parser.add_argument("-g", "--global_path", help="directory for generated hlsl files containing hlsl globals", default="")
+		A.parser.add_argument("-r", "--raw_path", help="directory for generated hlsl files containing ByteAddressBuffer loaders", default="")
+		A.parser.add_argument("-p", "--pack_flags", help="pack runs of bool and small enum members into uint bitfields", action="store_true")
 		A.known_struct_sizes = {}
 		A.all_structs = {}
+		A.enums = {} # name -> bits needed, or None when the range is unknown
+		A.mapped_types = {}
 		A.files = []
-		A.struct_stack = []
 
-	def ParseLines(A, lines):
-		line_pattern = r'^[\s]*(\w+)[\s]*(\w+)((\[([\w]*)\])*)';
-		matches = re.finditer(line_pattern, lines, re.MULTILINE)
+	def Error(A, file_name, line, message):
+		print(f"{file_name}:{line}: error: {message}")
+		exit(1)
+
+	def Tokenize(A, file):
+		# single pass over the file. tokens are (kind, text, start, end), use file.LineAt(start) for line numbers
+		tokens = [(match.lastgroup, match.group(match.lastgroup), match.start(match.lastgroup), match.end()) for match in TOKEN_PATTERN.finditer(file.content)]
+		tokens.pop() # eof
+		if tokens and tokens[-1][0] == "unterminated":
+			A.Error(file.name, file.LineAt(tokens[-1][2]), "unterminated comment")
+		return tokens
+
+	def FindPlainBody(A, tokens, i):
+		# returns the index of the closing brace, or minus the index after the brace balanced body when it nests braces
+		depth = 1
+		nested = False
+		num_tokens = len(tokens)
+		while i < num_tokens:
+			text = tokens[i][1]
+			if text == "{":
+				depth += 1
+				nested = True
+			elif text == "}":
+				depth -= 1
+				if depth == 0:
+					return -(i + 1) if nested else i
+			i += 1
+		return num_tokens
+
+	def ParseLines(A, file, tokens, i):
+		# parse members until the closing brace. returns index of the closing brace and the parsed members
 		output_lines = []
-
-		for match in matches:
-			num_groups = len(match.groups());
-			array_ext = None
+		num_tokens = len(tokens)
+		def Expect(i, what):
+			if i >= num_tokens:
+				A.Error(file.name, file.LineAt(tokens[-1][2]), f"unexpected end of file, expected {what}")
+			return tokens[i]
+
+		while True:
+			kind, text, member_pos, _ = Expect(i, "'}'")
+			if text == "}":
+				return i, output_lines
+			if text == "struct":
+				i += 1
+				kind, text, member_pos, _ = Expect(i, "type")
+			if kind == "member":
+				member_type, member_name, array_ext = MEMBER_PATTERN.match(text).groups()
+			else:
+				# members split by comments or with array expressions are parsed token by token
+				if kind != "ident":
+					A.Error(file.name, file.LineAt(member_pos), f"expected member type, got '{text}'")
+				member_type = text
+				kind, text, pos, _ = Expect(i + 1, "member name")
+				if kind != "ident":
+					A.Error(file.name, file.LineAt(pos), f"expected member name after '{member_type}', got '{text}'")
+				member_name = text
+				i += 2
+				array_ext = None
+				_, text, pos, _ = Expect(i, "';'")
+				if text == "[":
+					close = i + 1
+					while Expect(close, "']'")[1] != "]":
+						close += 1
+					array_ext = "".join(t[1] for t in tokens[i+1:close])
+					i = close + 1
+					_, text, pos, _ = Expect(i, "';'")
+					if text == "[":
+						A.Error(file.name, file.LineAt(pos), f"multidimensional arrays not supported '{member_name}'")
+				if text != ";":
+					A.Error(file.name, file.LineAt(pos), f"expected ';' after member '{member_name}', got '{text}'")
 			array_size = 0
-			if match.group(4):
-				if match.group(3) != match.group(4):
-					print(f"multidimensional arrays not supported '{match.group(3)}'")
-					exit(1)
+			if array_ext is not None:
 				array_size = 1
-				array_ext = match.group(5)
 				try:
 					array_size = int(array_ext)
 				except:
 					pass
-			l = Line(A, match.group(1), match.group(2), array_size, array_ext)
-			output_lines.append(l)
-		return output_lines
+			# types are resolved in ResolveStructs, once all files are parsed
+			output_lines.append((member_type, member_name, array_size, array_ext, member_pos))
+			i += 1
 
 		
+
 	def Pad2(A, offset, target):
 		off = offset
 		pad_string = ""
@@ -203,44 +303,159 @@ class CBufferGen:
 			off += count_bytes
 		return off, pad_string
 
-	def Parse(A, file_content, out_file, out_globals_file):
+	def ParseEnum(A, file, tokens, i):
+		# enum [class] NAME [: type] { A [= N], ... } ; returns index after the closing brace
+		i += 1
+		if tokens[i][1] in ("class", "struct"):
+			i += 1
+		if tokens[i][0] != "ident":
+			return i
+		enum_name = tokens[i][1]
+		enum_pos = tokens[i][2]
+		num_tokens = len(tokens)
+		underlying = []
+		i += 1
+		if i < num_tokens and tokens[i][1] == ":":
+			i += 1
+			while i < num_tokens and tokens[i][1] not in ("{", ";"):
+				if tokens[i][0] == "member":
+					return i + 1 #forward declaration with a two word type, enum E : unsigned int;
+				underlying.append(tokens[i][1])
+				i += 1
+		# members are stored as hlsl_uint, so anything wider than 32 bits can't be represented.
+		# long is 64 bit on LP64 targets, so it is rejected along with the always 64 bit spellings
+		wide = underlying[-1:] in (["int64_t"], ["uint64_t"], ["__int64"]) or "long" in underlying
+		underlying = " ".join(underlying)
+		if wide:
+			A.Error(file.name, file.LineAt(enum_pos), f"enum {enum_name}: underlying type '{underlying}' is wider than 32 bits")
+		while i < num_tokens and tokens[i][1] not in ("{", ";"):
+			i += 1
+		if i >= num_tokens or tokens[i][1] == ";":
+			return i #forward declaration
+		i += 1
+		value = -1
+		max_value = 0
+		known = True
+		while i < num_tokens and tokens[i][1] != "}":
+			if tokens[i][0] != "ident":
+				A.Error(file.name, file.LineAt(tokens[i][2]), f"expected enumerator in enum {enum_name}, got '{tokens[i][1]}'")
+			i += 1
+			if i < num_tokens and tokens[i][1] == "=":
+				expr = []
+				i += 1
+				while i < num_tokens and tokens[i][1] not in (",", "}"):
+					expr.append(tokens[i])
+					i += 1
+				try:
+					value = int(expr[0][1].rstrip("uUlL"), 0) if len(expr) == 1 and expr[0][0] == "number" else None
+				except:
+					value = None
+			elif value is not None:
+				value += 1
+			if value is None or value < 0:
+				known = False
+				value = None
+			else:
+				max_value = max(max_value, value)
+			if i < num_tokens and tokens[i][1] == ",":
+				i += 1
+		A.enums[enum_name] = max(1, max_value.bit_length()) if known else None
+		return i
+
+	def ResolveStructs(A):
+		# member types are mapped after every file is parsed, so enums and structs may come from any input file
+		for struct in A.all_structs.values():
+			lines = []
+			for member_type, member_name, array_size, array_ext, pos in struct.members:
+				l = Line(A, member_type, member_name, array_size, array_ext)
+				l.pos = pos
+				lines.append(l)
+			struct.lines = A.PackFlags(lines) if A.args.pack_flags else lines
+			for l in struct.lines:
+				if l.type_class == TypeClass.STRUCT:
+					struct.dependencies.add(l.type)
+
+	def IsPackable(A, l):
+		if l.array_size:
+			return False
+		if l.type == "bool":
+			return True
+		bits = A.enums.get(l.type)
+		return bits is not None and bits <= MAX_PACKED_ENUM_BITS
+
+	def PackFlags(A, lines):
+		# collapse runs of bool and small enum members into uint words. fields are (line, shift, bits)
+		output_lines = []
+		flags = None
+		for l in lines:
+			if not A.IsPackable(l):
+				flags = None
+				output_lines.append(l)
+				continue
+			bits = 1 if l.type == "bool" else A.enums[l.type]
+			if flags is None or flags.used_bits + bits > 32:
+				flags = Line(A, "uint", f"__flags{sum(1 for o in output_lines if o.packed_fields)}", 0, None)
+				flags.hlsl_cb_type = "hlsl_uint"
+				flags.used_bits = 0
+				flags.pos = l.pos
+				output_lines.append(flags)
+			flags.packed_fields.append((l, flags.used_bits, bits))
+			flags.used_bits += bits
+		return output_lines
+
+	def Parse(A, file_name, file_content, out_file, out_globals_file, out_raw_file):
 		
-		File = CBufferGenFile()
+		File = CBufferGenFile(file_name, file_content)
 		File.out_file = out_file
 		File.out_globals_file = out_globals_file
-		struct_pattern = r'struct ([^\s]+)[\s]+{([^{}]*)}[\s]*;'
+		File.out_raw_file = out_raw_file
+		tokens = A.Tokenize(File)
+		num_tokens = len(tokens)
 		pos = 0
-		end = len(file_content)
-
-		matches = re.finditer(struct_pattern, file_content, re.MULTILINE)
-		for match in matches:
-			idx = match.start()
-			end = match.end()
-			struct_name = match.group(1)
-			contents = match.group(2)
+		i = 0
+
+		while i < num_tokens:
+			if tokens[i][1] == "enum":
+				i = A.ParseEnum(File, tokens, i)
+				continue
+			# struct NAME { members } ; templates are left alone
+			if tokens[i][1] != "struct" or i + 2 >= num_tokens or tokens[i+1][0] != "ident" or tokens[i+2][1] != "{" or (i > 0 and tokens[i-1][1] == ">"):
+				i += 1
+				continue
+			idx = tokens[i][2]
+			struct_pos = tokens[i][2]
+			struct_name = tokens[i+1][1]
+			close = A.FindPlainBody(tokens, i + 3)
+			if close < 0:
+				# body has nested braces (methods, initializers, ...), not a cbuffer struct. leave it in the pre text
+				print(f"{file_name}:{File.LineAt(struct_pos)}: skipping struct {struct_name}, body contains braces")
+				i = -close
+				continue
+			i, lines = A.ParseLines(File, tokens, i + 3)
+			if i + 1 >= num_tokens or tokens[i+1][1] != ";":
+				# declares a variable or typedef name as well (struct B { ... } b;), leave it in the pre text
+				print(f"{file_name}:{File.LineAt(struct_pos)}: skipping struct {struct_name}, not followed by ';'")
+				i += 1
+				continue
+			end = tokens[i+1][3]
+			i += 2
 			#print stuff before match.
-			pre_text = "" 
-			if idx != pos:
-				pre_text = file_content[pos:idx]
-				pos = end
 			struct = CBufferGenStruct()
-			struct.pre_text = pre_text
-			struct.lines = A.ParseLines(contents)
+			struct.pre_text = file_content[pos:idx]
+			pos = end
+			struct.members = lines
 			struct.file = File
-			struct.parse_state = 0
+			struct.file_name = file_name
+			struct.pos = struct_pos
 			struct.name = struct_name
 			struct.cb_size = DELAYED_STRUCT_SIZE
-			for l in struct.lines:
-				if l.type_class == TypeClass.STRUCT:
-					struct.dependencies.add(l.type)
 			File.structs[struct_name] = struct
 			File.struct_order.append(struct_name)
 			if struct_name in A.all_structs:
-				print(f"error: duplicate struct {struct_name}")
-				exit(1)
+				other = A.all_structs[struct_name]
+				A.Error(file_name, File.LineAt(struct_pos), f"duplicate struct {struct_name}, previously defined at {other.file_name}:{other.file.LineAt(other.pos)}")
 			A.all_structs[struct_name] = struct
-		if pos != len(file_content):
-			File.tail_text = file_content[pos:]
+		File.tail_text = file_content[pos:]
 		A.files.append(File)
 
 	def WriteMembersRecurse(A, f, prefix, struct):
@@ -248,9 +463,144 @@ class CBufferGen:
 			if l.type_class == TypeClass.STRUCT:
 				#f.write(f"// {l.type} {prefix}.{l.name} \n")
 				A.WriteMembersRecurse(f, f"{prefix}.{l.name}", A.all_structs[l.type])
+			elif l.packed_fields:
+				for field, shift, bits in l.packed_fields:
+					f.write(f"#define {field.name:<40} {struct.name}_{field.name}({prefix})\n")
 			else:
 				f.write(f"#define {l.name:<40} {prefix}.{l.name}\n")
 
+	def RawLeaves(A, l, prefix, offset):
+		# flatten a scalar/vector/matrix/typedef member into (byte offset, byte size, base type, target) leaves
+		leaves = []
+		target = f"{prefix}{l.name}"
+		if l.type_class == TypeClass.TYPEDEF:
+			leaves.append((offset, l.hlsl_size, l.hlsl_base_type, target))
+		elif l.is_matrix:
+			row_stride = GetAlignedArrayElementSize(l.dim_x * l.hlsl_size)
+			for j in range(l.dim_y):
+				for c in range(l.dim_x):
+					leaves.append((offset + j * row_stride + c * l.hlsl_size, l.hlsl_size, l.hlsl_base_type, f"{target}[{c}][{j}]"))
+		else:
+			swizzle = l.type != l.hlsl_base_type
+			for c in range(l.dim_x):
+				t = f"{target}.{'xyzw'[c]}" if swizzle else target
+				leaves.append((offset + c * l.hlsl_size, l.hlsl_size, l.hlsl_base_type, t))
+		return leaves
+
+	def RawConvert(A, base_type, size, dwords, byte_offset):
+		if size == 2:
+			shift = (byte_offset % 4) * 8
+			if shift:
+				return f"(({dwords[0]} >> {shift}) & 0xffff)"
+			return f"({dwords[0]} & 0xffff)"
+		elif base_type == "double":
+			return f"asdouble({dwords[0]}, {dwords[1]})"
+		elif base_type == "float":
+			return f"asfloat({dwords[0]})"
+		elif base_type == "int":
+			return f"asint({dwords[0]})"
+		elif base_type == "bool":
+			return f"({dwords[0]} != 0)"
+		elif base_type == "uint" or (base_type in A.enums and A.args.pack_flags):
+			# packed structs declare enum members as uint
+			return dwords[0]
+		elif len(dwords) == 1:
+			# typedefs and enums, hlsl has no implicit conversion from uint to an enum
+			return f"({base_type}){dwords[0]}"
+		else:
+			return f"({base_type})uint{len(dwords)}({', '.join(dwords)})"
+
+	def WriteRawLoads(A, f, indent, base, leaves, tag):
+		# coalesce leaves into one Load/Load2/Load3/Load4 per 16 byte row
+		rows = {}
+		for leaf in leaves:
+			rows.setdefault(leaf[0] // 16, []).append(leaf)
+		for row in sorted(rows):
+			row_leaves = rows[row]
+			first = min(leaf[0] for leaf in row_leaves) // 4
+			last = max((leaf[0] + leaf[1] - 1) for leaf in row_leaves) // 4
+			count = last - first + 1
+			var = f"{tag}{row}"
+			if count == 1:
+				f.write(f"{indent}uint {var} = buf.Load({base} + {first * 4});\n")
+				names = [var]
+			else:
+				f.write(f"{indent}uint{count} {var} = buf.Load{count}({base} + {first * 4});\n")
+				names = [f"{var}.{'xyzw'[i]}" for i in range(count)]
+			for byte_offset, size, base_type, target in row_leaves:
+				lo = byte_offset // 4 - first
+				hi = (byte_offset + size - 1) // 4 - first
+				f.write(f"{indent}{target} = {A.RawConvert(base_type, size, names[lo:hi+1], byte_offset)};\n")
+
+	def WriteRawLoader(A, f, struct):
+		f.write(f"\n#define {struct.name.upper()}_RAW_SIZE {struct.cb_size}\n")
+		f.write(f"#define {struct.name.upper()}_RAW_STRIDE {GetAlignedArrayElementSize(struct.cb_size)}\n")
+		f.write(f"{struct.name} Load{struct.name}(ByteAddressBuffer buf, uint base)\n{{\n")
+		f.write(f"\t{struct.name} r;\n")
+		leaves = []
+		for l in struct.lines:
+			if l.array_size or l.type_class == TypeClass.STRUCT:
+				continue
+			leaves += A.RawLeaves(l, "r.", l.cb_offset)
+		A.WriteRawLoads(f, "\t", "base", leaves, "raw")
+		for l in struct.lines:
+			if l.type_class == TypeClass.STRUCT:
+				stride = GetAlignedArrayElementSize(A.all_structs[l.type].cb_size)
+				if l.array_size:
+					f.write(f"\tfor(uint i = 0; i < {l.array_ext_cb}; ++i)\n")
+					f.write(f"\t\tr.{l.name}[i] = Load{l.type}(buf, base + {l.cb_offset} + i * {stride});\n")
+				else:
+					f.write(f"\tr.{l.name} = Load{l.type}(buf, base + {l.cb_offset});\n")
+			elif l.array_size:
+				if l.type_class == TypeClass.TYPEDEF:
+					stride = GetAlignedArrayElementSize(l.hlsl_size)
+				else:
+					stride = GetAlignedArrayElementSize(l.dim_x * l.hlsl_size)
+				if l.is_matrix:
+					stride *= l.dim_y
+				element = A.RawLeaves(l, "r.", 0)
+				element = [(o, s, t, target.replace(f"r.{l.name}", f"r.{l.name}[i]", 1)) for o, s, t, target in element]
+				f.write(f"\tfor(uint i = 0; i < {l.array_ext_cb}; ++i)\n\t{{\n")
+				A.WriteRawLoads(f, "\t\t", f"base + {l.cb_offset} + i * {stride}", element, f"{l.name}_")
+				f.write(f"\t}}\n")
+		f.write(f"\treturn r;\n}}\n")
+
+	def WriteFlagAccessors(A, f, struct):
+		for l in struct.lines:
+			for field, shift, bits in l.packed_fields:
+				mask = (1 << bits) - 1
+				if field.type == "bool":
+					f.write(f"\tbool get_{field.name}() const {{ return (({l.name} >> {shift}) & 0x1) != 0; }}\n")
+					f.write(f"\tvoid set_{field.name}(bool v) {{ {l.name} = ({l.name} & ~(0x1u << {shift})) | ((hlsl_uint)(v ? 1 : 0) << {shift}); }}\n")
+				else:
+					f.write(f"\t{field.type} get_{field.name}() const {{ return ({field.type})(({l.name} >> {shift}) & 0x{mask:x}); }}\n")
+					f.write(f"\tvoid set_{field.name}({field.type} v) {{ {l.name} = ({l.name} & ~(0x{mask:x}u << {shift})) | (((hlsl_uint)v & 0x{mask:x}) << {shift}); }}\n")
+
+	def WritePackedHlslStructs(A, f, file):
+		# with packed flags the source header no longer matches the cbuffer layout, so shaders use these definitions instead
+		# written to both the globals and the raw file, the guard lets a shader include both
+		guard = re.sub(r"\W", "_", os.path.basename(file.name)[:-2]).upper() + "_PACKED_STRUCTS"
+		f.write(f"\n#if !defined(CBUFFERGEN_NO_STRUCTS) && !defined({guard})\n")
+		f.write(f"#define {guard}\n")
+		for struct_name in file.struct_order:
+			struct = file.structs[struct_name]
+			f.write(f"struct {struct_name}\n{{\n")
+			for l in struct.lines:
+				hlsl_type = "uint" if l.type in A.enums else l.type
+				comment = ""
+				if l.packed_fields:
+					comment = " //" + " ".join(f"{field.name}:{shift}" + (f"-{shift+bits-1}" if bits > 1 else "") for field, shift, bits in l.packed_fields)
+				f.write(f"\t{hlsl_type:<30} {l.name}{l.array_ext};{comment}\n")
+			f.write(f"}};\n")
+			for l in struct.lines:
+				for field, shift, bits in l.packed_fields:
+					if field.type == "bool":
+						f.write(f"bool {struct_name}_{field.name}({struct_name} s) {{ return ((s.{l.name} >> {shift}) & 0x1) != 0; }}\n")
+					else:
+						f.write(f"uint {struct_name}_{field.name}({struct_name} s) {{ return (s.{l.name} >> {shift}) & 0x{(1 << bits) - 1:x}; }}\n")
+			f.write(f"\n")
+		f.write(f"#endif //{guard}\n")
+
 	def MakeDir(A, filename):
 		dir_path = os.path.dirname(filename)
 		if dir_path:
@@ -268,7 +618,8 @@ class CBufferGen:
 					f.write(f"//plain struct\n")
 					f.write(f"struct {struct_name}\n{{\n")
 					for l in struct.lines:
-						f.write(f"\t{l.hlsl_type:<30} {l.name}{l.array_ext};\n")
+						for field in ([p[0] for p in l.packed_fields] or [l]):
+							f.write(f"\t{field.hlsl_type:<30} {field.name}{field.array_ext};\n")
 					f.write(f"}};\n\n")		
 					f.write(f"//const buffer struct\n")
 					f.write(f"struct {struct_name}_cb\n{{\n")
@@ -282,7 +633,14 @@ class CBufferGen:
 						s4 = (offset+l.cb_size)
 						f.write(f"\t{l.hlsl_cb_type:<50} {n:<40}//[{s3}-{s4}]\n")
 						offset += l.cb_size
+					A.WriteFlagAccessors(f, struct)
+					f.write(f"#ifdef CBUFFERGEN_CAPTURE\n")
+					f.write(f"\tstatic constexpr uint32_t CAPTURE_ID = 0x{CaptureId(struct_name):08x};\n")
+					f.write(f"\tstatic constexpr const char* CAPTURE_NAME = \"{struct_name}\";\n")
+					f.write(f"#endif\n")
 					f.write(f"}}; // struct size:{offset}\n")
+				if file.tail_text.strip():
+					f.write(file.tail_text)
 
 			if file.out_globals_file:
 				A.MakeDir(file.out_globals_file)
@@ -292,6 +650,8 @@ class CBufferGen:
 // This file contains helper defines to let all members look like globals
 // This is mainly a workaround to make it easier to port/reuse older code that relies on this.
 """)
+					if A.args.pack_flags:
+						A.WritePackedHlslStructs(f, file)
 					for struct_name in file.struct_order:
 						struct = file.structs[struct_name]
 						f.write(f"\n\n#ifdef {struct_name.upper()}_GLOBALS\n")
@@ -299,73 +659,106 @@ class CBufferGen:
 						A.WriteMembersRecurse(f, f"{struct_name.upper()}_GLOBALS", struct)
 						f.write(f"#endif //{struct_name.upper()}_GLOBALS\n\n")
 
-
-	def CalcSizes(A):
-		for struct_name in A.all_structs:
-			A.ParseRecursive(A.all_structs[struct_name])
-
-	def ParsePush(A, struct):
-		A.struct_stack.append(struct)
-
-	def ParsePop(A):
-		A.struct_stack.pop()
-
-	def ParseDump(A):
-		print(f"Recursive struct references")
-		for s in A.struct_stack:
-			print(f"\t{s.name}")
+			if file.out_raw_file:
+				A.MakeDir(file.out_raw_file)
+				with open(file.out_raw_file, "w") as f:
+					print(f"write {file.out_raw_file}")
+					f.write("""//File generated by cbuffergen.py. Do not modify
+// This file contains loaders that read structs from a ByteAddressBuffer, for data too large for a constant buffer.
+// The buffer must be filled with the _cb structs from the generated c header, starting at a 16 byte aligned address.
+#pragma once
+""")
+					# loaders of structs from other input files live in those files' raw output
+					dep_files = {A.all_structs[dep_name].file for struct in file.structs.values() for dep_name in struct.dependencies}
+					for dep_file in sorted(dep_files - {file}, key=lambda dep_file: dep_file.out_raw_file):
+						f.write(f'#include "{os.path.basename(dep_file.out_raw_file)}"\n')
+					if A.args.pack_flags:
+						A.WritePackedHlslStructs(f, file)
+					for struct_name in file.struct_order:
+						A.WriteRawLoader(f, file.structs[struct_name])
 
 
-	def ParseRecursive(A, struct):
-		parse_state = struct.parse_state
-		if parse_state == 0:
-			struct.parse_state = 1
-			A.ParsePush(struct)
+	def CalcSizes(A):
+		# iterative topological sort: a struct is laid out once all structs it contains are
+		dependents = {struct_name: [] for struct_name in A.all_structs}
+		pending = {}
+		ready = []
+		for struct_name, struct in A.all_structs.items():
 			for dep_name in struct.dependencies:
 				if not dep_name in A.all_structs:
-					print(f"unknown struct {dep_name}")
-				dep_struct = A.all_structs[dep_name]
-				A.ParseRecursive(dep_struct)
-			offset = 0
-			for l in struct.lines:
-				output_type = l.hlsl_type
-				offset_before = offset
-				pad_string = ""
-				if l.cb_align == 16:
+					for l in struct.lines:
+						if l.type == dep_name:
+							A.Error(struct.file_name, struct.file.LineAt(l.pos), f"unknown struct {dep_name} in {struct_name}")
+				dependents[dep_name].append(struct_name)
+			pending[struct_name] = len(struct.dependencies)
+			if pending[struct_name] == 0:
+				ready.append(struct_name)
+
+		while ready:
+			struct_name = ready.pop()
+			A.LayoutStruct(A.all_structs[struct_name])
+			for dependent in dependents[struct_name]:
+				pending[dependent] -= 1
+				if pending[dependent] == 0:
+					ready.append(dependent)
+
+		unresolved = [struct_name for struct_name in pending if pending[struct_name] > 0]
+		if unresolved:
+			A.ReportCycle(unresolved[0], pending)
+
+	def ReportCycle(A, struct_name, pending):
+		# every unresolved struct depends on at least one other unresolved struct, so walking those edges must revisit a struct
+		path = []
+		visited = {}
+		while not struct_name in visited:
+			visited[struct_name] = len(path)
+			path.append(struct_name)
+			struct = A.all_structs[struct_name]
+			struct_name = min(dep_name for dep_name in struct.dependencies if pending[dep_name] > 0)
+		cycle = path[visited[struct_name]:] + [struct_name]
+		print(f"Recursive struct references")
+		for idx in range(len(cycle) - 1):
+			struct = A.all_structs[cycle[idx]]
+			l = next(l for l in struct.lines if l.type == cycle[idx+1])
+			print(f"{struct.file_name}:{struct.file.LineAt(l.pos)}: {struct.name}.{l.name} contains {cycle[idx+1]}")
+		exit(1)
+
+	def LayoutStruct(A, struct):
+		offset = 0
+		for l in struct.lines:
+			pad_string = ""
+			if l.cb_align == 16:
+				padded_offset, pad_string = A.Pad2(offset, 16)
+				offset = padded_offset
+			else:
+				if (offset % 16) + l.cb_size > 16:
 					padded_offset, pad_string = A.Pad2(offset, 16)
 					offset = padded_offset
-				else:
-					if (offset % 16) + l.cb_size > 16:
-						padded_offset, pad_string = A.Pad2(offset, 16)
-						offset = padded_offset
-					elif l.cb_align == 2:
-						assert (offset % 2) == 0
-					elif l.cb_align == 8:
-						padded_offset, pad_string = A.Pad2(offset, 8)
-						offset = padded_offset
-
-					
-				l.cb_offset = offset
-				l.cb_pad_string = pad_string
-				if l.cb_size == DELAYED_STRUCT_SIZE:
-					decl_struct = A.all_structs[l.type]
-					l.cb_size = decl_struct.cb_size
-					if l.array_size:
-						l.cb_size = GetArraySize(l.cb_size, l.array_size)
-					if decl_struct.cb_size == DELAYED_STRUCT_SIZE:
-						print(f"struct size for {l.type} unresolved")
-						exit(1)
-				offset += l.cb_size
-			struct.cb_size = offset
-			A.ParsePop()
-			struct.parse_state = 2
-		elif parse_state == 1:
-			ParseDump()
-		elif parse_state == 2:
-			pass #already processed
+				elif l.cb_align == 2:
+					assert (offset % 2) == 0
+				elif l.cb_align == 8:
+					padded_offset, pad_string = A.Pad2(offset, 8)
+					offset = padded_offset
+
+				
+			l.cb_offset = offset
+			l.cb_pad_string = pad_string
+			if l.cb_size == DELAYED_STRUCT_SIZE:
+				decl_struct = A.all_structs[l.type]
+				l.cb_size = decl_struct.cb_size
+				if l.array_size:
+					l.cb_size = GetArraySize(l.cb_size, l.array_size)
+				if decl_struct.cb_size == DELAYED_STRUCT_SIZE:
+					print(f"struct size for {l.type} unresolved")
+					exit(1)
+			offset += l.cb_size
+		struct.cb_size = offset
 
 
 	def MapType(A, type):
+		# only called once all files are parsed, so the mapping of a type name never changes
+		if type in A.mapped_types:
+			return A.mapped_types[type]
 		type_pattern = r'(uint16_t|float|int|uint|bool|double)(([1-4])(x([1-4]))?)?';
 		match = re.match(type_pattern, type)
 		type_name = "?"
@@ -374,7 +767,10 @@ class CBufferGen:
 		size = 4
 		type_class = TypeClass.BUILTIN
 		external = 0
-		if match:
+		if type in A.enums:
+			type_name = type
+			type_class = TypeClass.TYPEDEF
+		elif match:
 			#builtin or array type
 			type_name = f'{match.group(1)}'
 			if "uint16_t" in type_name:
@@ -399,7 +795,8 @@ class CBufferGen:
 				size = DELAYED_STRUCT_SIZE
 
 
-		return type_name, size, dim_x, dim_y, type_class
+		A.mapped_types[type] = (type_name, size, dim_x, dim_y, type_class)
+		return A.mapped_types[type]
 
 
 	def FixupIncludes(A, input_string, filenames):
@@ -428,12 +825,16 @@ class CBufferGen:
 		print("input path %s" % A.args.input_path)
 		print("c path %s" % A.args.c_path)
 		print("global path %s" % A.args.global_path)
+		print("raw path %s" % A.args.raw_path)
+		if A.args.pack_flags and not (A.args.global_path or A.args.raw_path):
+			print("error: --pack_flags needs --global_path or --raw_path, shaders get the packed struct definitions from there")
+			exit(1)
 
 		input_files = []
 		
 		for filename in os.listdir(A.args.input_path):
 			if filename.endswith(".h"):
-				if not (filename.endswith(".cpp.h") or filename.endswith(".globals.h")):
+				if not (filename.endswith(".cpp.h") or filename.endswith(".globals.h") or filename in SupportFiles):
 					input_files.append(filename)
 
 		for filename in input_files:
@@ -446,9 +847,13 @@ class CBufferGen:
 				A.known_structs = {}
 				output_file = f"{A.args.c_path}/{filename[:-2]}.cpp.h"
 				output_globals_file = ""
+				output_raw_file = ""
 				if A.args.global_path:
 					output_globals_file = f"{A.args.global_path}/{filename[:-2]}.globals.hlsl"
-					A.Parse(file_string, output_file, output_globals_file)
+				if A.args.raw_path:
+					output_raw_file = f"{A.args.raw_path}/{filename[:-2]}.raw.hlsl"
+				A.Parse(input_file.name, file_string, output_file, output_globals_file, output_raw_file)
+		A.ResolveStructs()
 		A.CalcSizes()
 		A.WriteFiles()
 
@@ -0,0 +1,307 @@
+#pragma once
+// Runtime cbuffer layouts, for parameter blocks defined in data that cbuffergen.py never sees.
+// Members are placed with the same rules as the generator and hlsl_layout in hlsltypes.h.
+//
+//		CBufferLayoutBuilder B;
+//		B.Add("tint", CBufferType::Float, 4);
+//		B.Add("uvTransform", CBufferType::Float, 3, 2);		// float3x2
+//		B.Add("weights", CBufferType::Float, 1, 0, 8);		// float weights[8]
+//		const CBufferLayout* layout = B.Build();				// cached, materials with the same members share it
+//		uint32_t tint = layout->Find("tint");				// resolve names once
+//		...
+//		layout->Set(mapped, tint, color);					// straight into the mapped buffer
+//
+// Source data is tightly packed: vector arrays and matrix columns are consecutive, bools are 32 bit ints
+// and struct members take the nested layout's cbuffer bytes.
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define CBUFFER_LAYOUT_INVALID 0xffffffff
+
+enum class CBufferType : uint8_t
+{
+	Float,
+	Int,
+	Uint,
+	Bool,
+	Uint16,
+	Double,
+	Struct,
+};
+
+struct CBufferLayout;
+
+struct CBufferLayoutMemberDesc
+{
+	std::string name;
+	CBufferType type;
+	uint32_t columns;					// vector length, 1-4
+	uint32_t rows;						// matrix registers, 0 for scalars and vectors
+	uint32_t array_size;				// 0 when not an array
+	const CBufferLayout* layout;		// nested layout for CBufferType::Struct
+};
+
+typedef void (*CBufferWriteFn)(char* dst, const char* src, uint32_t reg_size, uint32_t count);
+
+// every member is written as count registers of reg_size bytes, each starting 16 byte aligned in the cbuffer
+struct CBufferLayoutMember
+{
+	uint32_t offset;
+	uint32_t reg_size;
+	uint32_t reg_count;
+	uint32_t regs_per_element;			// registers in one array element
+	CBufferWriteFn write;
+	CBufferType type;
+};
+
+inline uint32_t CBufferLayoutAlign(uint32_t offset, uint32_t align)
+{
+	return align * ((offset + align - 1) / align);
+}
+
+inline uint64_t CBufferLayoutHash(uint64_t h, const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for(size_t i = 0; i < size; ++i)
+		h = (h ^ bytes[i]) * 0x100000001b3ull;
+	return h;
+}
+
+template<uint32_t SIZE>
+void CBufferWriteFixed(char* dst, const char* src, uint32_t, uint32_t)
+{
+	memcpy(dst, src, SIZE);
+}
+
+inline void CBufferWriteContiguous(char* dst, const char* src, uint32_t reg_size, uint32_t count)
+{
+	memcpy(dst, src, (size_t)reg_size * count);
+}
+
+template<uint32_t SIZE>
+void CBufferWriteRows(char* dst, const char* src, uint32_t, uint32_t count)
+{
+	for(uint32_t i = 0; i < count; ++i)
+		memcpy(dst + i * 16, src + i * SIZE, SIZE);
+}
+
+inline void CBufferWriteRowsAny(char* dst, const char* src, uint32_t reg_size, uint32_t count)
+{
+	uint32_t stride = CBufferLayoutAlign(reg_size, 16);
+	for(uint32_t i = 0; i < count; ++i)
+		memcpy(dst + (size_t)i * stride, src + (size_t)i * reg_size, reg_size);
+}
+
+inline CBufferWriteFn CBufferSelectWrite(uint32_t reg_size, uint32_t reg_count)
+{
+	if(reg_count == 1 || reg_size % 16 == 0)
+	{
+		if(reg_count == 1)
+		{
+			switch(reg_size)
+			{
+			case 2: return CBufferWriteFixed<2>;
+			case 4: return CBufferWriteFixed<4>;
+			case 8: return CBufferWriteFixed<8>;
+			case 12: return CBufferWriteFixed<12>;
+			case 16: return CBufferWriteFixed<16>;
+			}
+		}
+		return CBufferWriteContiguous;
+	}
+	switch(reg_size)
+	{
+	case 4: return CBufferWriteRows<4>;
+	case 8: return CBufferWriteRows<8>;
+	case 12: return CBufferWriteRows<12>;
+	}
+	return CBufferWriteRowsAny;
+}
+
+struct CBufferLayout
+{
+	uint64_t hash = 0;
+	uint32_t size = 0;
+	std::vector<CBufferLayoutMember> members;
+	std::vector<std::pair<uint64_t, uint32_t>> lookup;		// (name hash, member index), sorted
+	std::vector<CBufferLayoutMemberDesc> descs;
+
+	uint32_t Find(const char* name) const
+	{
+		uint64_t h = CBufferLayoutHash(0xcbf29ce484222325ull, name, strlen(name));
+		auto it = std::lower_bound(lookup.begin(), lookup.end(), std::make_pair(h, 0u));
+		for(; it != lookup.end() && it->first == h; ++it)
+		{
+			if(descs[it->second].name == name)
+				return it->second;
+		}
+		return CBUFFER_LAYOUT_INVALID;
+	}
+
+	// writes the whole member. returns false when the member does not exist, e.g. CBUFFER_LAYOUT_INVALID from Find
+	bool Write(void* mapped, uint32_t index, const void* src) const
+	{
+		if(index >= members.size())
+			return false;
+		const CBufferLayoutMember& m = members[index];
+		m.write((char*)mapped + m.offset, (const char*)src, m.reg_size, m.reg_count);
+		return true;
+	}
+	// writes one element of an array member. returns false when the member or the element does not exist
+	bool WriteElement(void* mapped, uint32_t index, uint32_t element, const void* src) const
+	{
+		if(index >= members.size())
+			return false;
+		const CBufferLayoutMember& m = members[index];
+		if(element >= m.reg_count / m.regs_per_element)
+			return false;
+		uint32_t first = element * m.regs_per_element;
+		m.write((char*)mapped + m.offset + first * CBufferLayoutAlign(m.reg_size, 16), (const char*)src, m.reg_size, m.regs_per_element);
+		return true;
+	}
+
+	// typed writes, return false when the member does not exist or has a different type
+	bool Set(void* mapped, uint32_t index, const float* v) const { return WriteChecked(mapped, index, v, Check(index, CBufferType::Float)); }
+	bool Set(void* mapped, uint32_t index, const int32_t* v) const { return WriteChecked(mapped, index, v, Check(index, CBufferType::Int) || Check(index, CBufferType::Bool)); }
+	bool Set(void* mapped, uint32_t index, const uint32_t* v) const { return WriteChecked(mapped, index, v, Check(index, CBufferType::Uint)); }
+	bool Set(void* mapped, uint32_t index, const uint16_t* v) const { return WriteChecked(mapped, index, v, Check(index, CBufferType::Uint16)); }
+	bool Set(void* mapped, uint32_t index, const double* v) const { return WriteChecked(mapped, index, v, Check(index, CBufferType::Double)); }
+
+	bool Check(uint32_t index, CBufferType type) const
+	{
+		return index < members.size() && members[index].type == type;
+	}
+	bool WriteChecked(void* mapped, uint32_t index, const void* src, bool valid) const
+	{
+		return valid && Write(mapped, index, src);
+	}
+};
+
+class CBufferLayoutBuilder
+{
+public:
+	CBufferLayoutBuilder& Add(const char* name, CBufferType type, uint32_t columns = 1, uint32_t rows = 0, uint32_t array_size = 0)
+	{
+		Members.push_back({name, type, columns, rows, array_size, nullptr});
+		return *this;
+	}
+	CBufferLayoutBuilder& AddStruct(const char* name, const CBufferLayout* layout, uint32_t array_size = 0)
+	{
+		Members.push_back({name, CBufferType::Struct, 1, 0, array_size, layout});
+		return *this;
+	}
+	void Reset()
+	{
+		Members.clear();
+	}
+
+	// returns nullptr for invalid member lists. layouts live until the process exits
+	const CBufferLayout* Build() const;
+
+	std::vector<CBufferLayoutMemberDesc> Members;
+};
+
+struct CBufferLayoutCache
+{
+	std::mutex lock;
+	std::unordered_map<uint64_t, std::vector<std::unique_ptr<CBufferLayout>>> layouts;
+};
+
+inline CBufferLayoutCache& CBufferLayoutCacheGet()
+{
+	static CBufferLayoutCache cache;
+	return cache;
+}
+
+inline uint32_t CBufferTypeSize(CBufferType type)
+{
+	switch(type)
+	{
+	case CBufferType::Uint16: return 2;
+	case CBufferType::Double: return 8;
+	default: return 4;
+	}
+}
+
+inline bool CBufferLayoutDescEqual(const CBufferLayoutMemberDesc& a, const CBufferLayoutMemberDesc& b)
+{
+	return a.name == b.name && a.type == b.type && a.columns == b.columns && a.rows == b.rows && a.array_size == b.array_size && a.layout == b.layout;
+}
+
+inline const CBufferLayout* CBufferLayoutBuilder::Build() const
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for(const CBufferLayoutMemberDesc& d : Members)
+	{
+		if(d.type == CBufferType::Struct ? !d.layout : (d.columns < 1 || d.columns > 4 || d.rows > 4))
+			return nullptr;
+		uint32_t shape[4] = { (uint32_t)d.type, d.columns, d.rows, d.array_size };
+		hash = CBufferLayoutHash(hash, d.name.c_str(), d.name.size() + 1);
+		hash = CBufferLayoutHash(hash, shape, sizeof(shape));
+		if(d.layout)
+			hash = CBufferLayoutHash(hash, &d.layout->hash, sizeof(d.layout->hash));
+	}
+
+	CBufferLayoutCache& cache = CBufferLayoutCacheGet();
+	std::lock_guard<std::mutex> guard(cache.lock);
+	std::vector<std::unique_ptr<CBufferLayout>>& bucket = cache.layouts[hash];
+	for(const std::unique_ptr<CBufferLayout>& layout : bucket)
+	{
+		if(std::equal(layout->descs.begin(), layout->descs.end(), Members.begin(), Members.end(), CBufferLayoutDescEqual))
+			return layout.get();
+	}
+
+	std::unique_ptr<CBufferLayout> layout(new CBufferLayout);
+	layout->hash = hash;
+	layout->descs = Members;
+	uint32_t offset = 0;
+	for(uint32_t i = 0; i < (uint32_t)Members.size(); ++i)
+	{
+		const CBufferLayoutMemberDesc& d = Members[i];
+		CBufferLayoutMember m;
+		m.type = d.type;
+		uint32_t elements = d.array_size ? d.array_size : 1;
+		uint32_t align;
+		if(d.type == CBufferType::Struct)
+		{
+			m.reg_size = d.layout->size;
+			m.regs_per_element = 1;
+			align = 16;
+		}
+		else
+		{
+			m.reg_size = CBufferTypeSize(d.type) * d.columns;
+			m.regs_per_element = d.rows ? d.rows : 1;
+			align = (d.rows || d.array_size) ? 16 : CBufferTypeSize(d.type);
+		}
+		m.reg_count = m.regs_per_element * elements;
+		uint32_t size = (m.reg_count - 1) * CBufferLayoutAlign(m.reg_size, 16) + m.reg_size;
+
+		// same rules as CBufferGen.LayoutStruct
+		if(align == 16 || (offset % 16) + size > 16)
+			offset = CBufferLayoutAlign(offset, 16);
+		else if(align == 8)
+			offset = CBufferLayoutAlign(offset, 8);
+		m.offset = offset;
+		m.write = CBufferSelectWrite(m.reg_size, m.reg_count);
+		offset += size;
+		layout->members.push_back(m);
+		layout->lookup.push_back({CBufferLayoutHash(0xcbf29ce484222325ull, d.name.c_str(), d.name.size()), i});
+	}
+	layout->size = offset;
+	std::sort(layout->lookup.begin(), layout->lookup.end());
+	for(size_t i = 1; i < layout->lookup.size(); ++i)
+	{
+		if(layout->lookup[i - 1].first == layout->lookup[i].first && Members[layout->lookup[i - 1].second].name == Members[layout->lookup[i].second].name)
+			return nullptr; // duplicate member name
+	}
+	bucket.push_back(std::move(layout));
+	return bucket.back().get();
+}
@@ -0,0 +1,299 @@
+// Replays a capture written with cbuffercapture.h and reports upload throughput and how much data actually changes.
+//
+//		c++ -O2 -std=c++17 cbufferreplay.cpp -o cbufferreplay
+//		./cbufferreplay frames.cbcap [iterations]
+//
+// Each record is replayed through three paths:
+//	pack:	copy every update into an upload ring, at CBUFFER_REPLAY_RING_ALIGN like a mapped constant buffer
+//	dedup:	compare each update with the last one of the same struct, and only copy it to the ring when it differs
+//	stream:	keep one slot per struct, standing in for a persistently mapped buffer, and copy only the 16 byte rows that changed into it
+// In every path the first update of a struct is always written.
+// Change statistics count bytes and 16 byte rows that differ from the previous update of the same struct.
+
+#include "cbuffercapture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CBUFFER_REPLAY_RING_SIZE (64 << 20)
+#define CBUFFER_REPLAY_RING_ALIGN 256
+
+struct ReplayStruct
+{
+	uint32_t id = 0;
+	uint32_t size = 0;
+	std::string name;
+	uint64_t updates = 0;
+	uint64_t unchanged = 0;
+	uint64_t bytes_changed = 0;
+	uint64_t rows_changed = 0;
+	uint64_t slot = 0;					// offset of the struct's slot in the stream buffer
+	std::vector<char> shadow;
+};
+
+struct ReplayUpdate
+{
+	uint32_t index;
+	uint32_t size;
+	const char* payload;
+};
+
+struct ReplayRing
+{
+	char* data;
+	uint64_t pos = 0;
+	char* Alloc(uint32_t size)
+	{
+		uint64_t aligned = (size + CBUFFER_REPLAY_RING_ALIGN - 1) & ~(uint64_t)(CBUFFER_REPLAY_RING_ALIGN - 1);
+		if(pos + aligned > CBUFFER_REPLAY_RING_SIZE)
+			pos = 0;
+		char* ptr = data + pos;
+		pos += aligned;
+		return ptr;
+	}
+};
+
+static double ReplaySeconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t ReplayPack(const std::vector<ReplayUpdate>& updates, ReplayRing& ring)
+{
+	uint64_t bytes = 0;
+	for(const ReplayUpdate& u : updates)
+	{
+		memcpy(ring.Alloc(u.size), u.payload, u.size);
+		bytes += u.size;
+	}
+	return bytes;
+}
+
+static uint64_t ReplayDedup(const std::vector<ReplayUpdate>& updates, std::vector<ReplayStruct>& structs, ReplayRing& ring)
+{
+	uint64_t bytes = 0;
+	std::vector<bool> seen(structs.size());
+	for(const ReplayUpdate& u : updates)
+	{
+		char* shadow = structs[u.index].shadow.data();
+		if(seen[u.index] && 0 == memcmp(shadow, u.payload, u.size))
+			continue;
+		seen[u.index] = true;
+		memcpy(shadow, u.payload, u.size);
+		memcpy(ring.Alloc(u.size), u.payload, u.size);
+		bytes += u.size;
+	}
+	return bytes;
+}
+
+static uint64_t ReplayStreamRows(const std::vector<ReplayUpdate>& updates, std::vector<ReplayStruct>& structs, char* mapped)
+{
+	uint64_t bytes = 0;
+	std::vector<bool> seen(structs.size());
+	for(const ReplayUpdate& u : updates)
+	{
+		ReplayStruct& s = structs[u.index];
+		char* shadow = s.shadow.data();
+		char* dst = mapped + s.slot;
+		bool first = !seen[u.index];
+		seen[u.index] = true;
+		for(uint32_t row = 0; row < u.size; row += 16)
+		{
+			uint32_t row_size = row + 16 < u.size ? 16 : u.size - row;
+			if(!first && 0 == memcmp(shadow + row, u.payload + row, row_size))
+				continue;
+			memcpy(shadow + row, u.payload + row, row_size);
+			memcpy(dst + row, u.payload + row, row_size);
+			bytes += row_size;
+		}
+	}
+	return bytes;
+}
+
+static void ReplayCountChanges(const std::vector<ReplayUpdate>& updates, std::vector<ReplayStruct>& structs)
+{
+	std::vector<bool> seen(structs.size());
+	for(ReplayStruct& s : structs)
+		memset(s.shadow.data(), 0, s.shadow.size());
+	for(const ReplayUpdate& u : updates)
+	{
+		ReplayStruct& s = structs[u.index];
+		char* shadow = s.shadow.data();
+		s.updates++;
+		if(seen[u.index] && 0 == memcmp(shadow, u.payload, u.size))
+		{
+			s.unchanged++;
+			continue;
+		}
+		for(uint32_t row = 0; row < u.size; row += 16)
+		{
+			uint32_t row_end = row + 16 < u.size ? row + 16 : u.size;
+			uint32_t changed = 0;
+			for(uint32_t i = row; i < row_end; ++i)
+				changed += shadow[i] != u.payload[i] || !seen[u.index];
+			s.bytes_changed += changed;
+			s.rows_changed += changed != 0;
+		}
+		seen[u.index] = true;
+		memcpy(shadow, u.payload, u.size);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2)
+	{
+		printf("usage: %s <capture file> [iterations]\n", argv[0]);
+		return 1;
+	}
+	int iterations = argc > 2 ? atoi(argv[2]) : 10;
+	if(iterations < 1)
+		iterations = 1;
+
+	int fd = open(argv[1], O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(CBufferCaptureHeader))
+	{
+		printf("error: cannot read capture %s\n", argv[1]);
+		return 1;
+	}
+	void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(mapped == MAP_FAILED)
+	{
+		printf("error: cannot map capture %s\n", argv[1]);
+		return 1;
+	}
+	const CBufferCaptureHeader* header = (const CBufferCaptureHeader*)mapped;
+	if(header->magic != CBUFFER_CAPTURE_MAGIC || header->version != CBUFFER_CAPTURE_VERSION)
+	{
+		printf("error: %s is not a version %d capture\n", argv[1], CBUFFER_CAPTURE_VERSION);
+		return 1;
+	}
+	uint64_t used = header->used.load();
+	if(sizeof(CBufferCaptureHeader) + used > (uint64_t)st.st_size)
+	{
+		printf("warning: capture truncated, %llu of %llu record bytes present\n", (unsigned long long)(st.st_size - sizeof(CBufferCaptureHeader)), (unsigned long long)used);
+		used = st.st_size - sizeof(CBufferCaptureHeader);
+	}
+	const char* data = (const char*)mapped + sizeof(CBufferCaptureHeader);
+
+	std::vector<ReplayStruct> structs;
+	std::unordered_map<uint32_t, uint32_t> struct_index;
+	std::vector<ReplayUpdate> updates;
+	uint32_t first_frame = 0xffffffff, last_frame = 0;
+	uint64_t payload_bytes = 0;
+	uint64_t pos = 0;
+	while(pos + sizeof(CBufferCaptureRecord) <= used)
+	{
+		const CBufferCaptureRecord* record = (const CBufferCaptureRecord*)(data + pos);
+		uint64_t record_size = CBufferCaptureRecordSize(record->size);
+		if(pos + record_size > used)
+		{
+			printf("warning: partial record at offset %llu\n", (unsigned long long)pos);
+			break;
+		}
+		pos += record_size;
+		const char* payload = (const char*)(record + 1);
+		auto it = struct_index.find(record->id);
+		if(it == struct_index.end())
+		{
+			it = struct_index.emplace(record->id, (uint32_t)structs.size()).first;
+			structs.emplace_back();
+			structs.back().id = record->id;
+		}
+		ReplayStruct& s = structs[it->second];
+		if(record->frame == CBUFFER_CAPTURE_NAME_FRAME)
+		{
+			s.name.assign(payload, record->size);
+			continue;
+		}
+		if(s.size == 0)
+		{
+			s.size = record->size;
+			s.shadow.resize(s.size);
+		}
+		else if(s.size != record->size)
+		{
+			printf("error: struct %08x changes size from %u to %u at frame %u\n", s.id, s.size, record->size, record->frame);
+			return 1;
+		}
+		updates.push_back({it->second, record->size, payload});
+		payload_bytes += record->size;
+		first_frame = record->frame < first_frame ? record->frame : first_frame;
+		last_frame = record->frame > last_frame ? record->frame : last_frame;
+	}
+	if(updates.empty())
+	{
+		printf("capture contains no updates\n");
+		return 0;
+	}
+	uint32_t frames = last_frame - first_frame + 1;
+
+	ReplayRing ring;
+	ring.data = (char*)malloc(CBUFFER_REPLAY_RING_SIZE);
+	memset(ring.data, 0, CBUFFER_REPLAY_RING_SIZE);
+	//warm up: touches the capture pages and the ring
+	ReplayPack(updates, ring);
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t pack_bytes = 0;
+	for(int i = 0; i < iterations; ++i)
+		pack_bytes += ReplayPack(updates, ring);
+	double pack_time = ReplaySeconds(start);
+
+	start = std::chrono::steady_clock::now();
+	uint64_t dedup_bytes = 0;
+	for(int i = 0; i < iterations; ++i)
+		dedup_bytes += ReplayDedup(updates, structs, ring);
+	double dedup_time = ReplaySeconds(start);
+
+	uint64_t stream_size = 0;
+	for(ReplayStruct& s : structs)
+	{
+		s.slot = stream_size;
+		stream_size += (s.size + CBUFFER_REPLAY_RING_ALIGN - 1) & ~(uint64_t)(CBUFFER_REPLAY_RING_ALIGN - 1);
+	}
+	char* stream_buffer = (char*)malloc(stream_size ? stream_size : 1);
+	memset(stream_buffer, 0, stream_size);
+	start = std::chrono::steady_clock::now();
+	uint64_t stream_bytes = 0;
+	for(int i = 0; i < iterations; ++i)
+		stream_bytes += ReplayStreamRows(updates, structs, stream_buffer);
+	double stream_time = ReplaySeconds(start);
+
+	ReplayCountChanges(updates, structs);
+
+	double processed = (double)payload_bytes * iterations;
+	printf("capture:  %llu updates, %u structs, %u frames, %.2f MB payload, %.1f KB/frame", (unsigned long long)updates.size(), (uint32_t)structs.size(), frames, payload_bytes / (1024.0 * 1024.0), payload_bytes / 1024.0 / frames);
+	if(header->dropped.load())
+		printf(", %llu updates dropped at capture", (unsigned long long)header->dropped.load());
+	printf("\n");
+	printf("pack:     %8.2f GB/s %10.2f Mupdates/s  uploaded %.2f MB/iteration\n", processed / pack_time / 1e9, updates.size() * iterations / pack_time / 1e6, pack_bytes / (double)iterations / (1024.0 * 1024.0));
+	printf("dedup:    %8.2f GB/s %10.2f Mupdates/s  uploaded %.2f MB/iteration\n", processed / dedup_time / 1e9, updates.size() * iterations / dedup_time / 1e6, dedup_bytes / (double)iterations / (1024.0 * 1024.0));
+	printf("stream:   %8.2f GB/s %10.2f Mupdates/s  uploaded %.2f MB/iteration\n", processed / stream_time / 1e9, updates.size() * iterations / stream_time / 1e6, stream_bytes / (double)iterations / (1024.0 * 1024.0));
+	printf("\n%-32s %6s %10s %10s %12s %12s\n", "struct", "size", "updates", "unchanged", "bytes chg%", "rows chg%");
+	for(const ReplayStruct& s : structs)
+	{
+		if(!s.updates)
+			continue;
+		char id[16];
+		snprintf(id, sizeof(id), "%08x", s.id);
+		double total = (double)s.updates * s.size;
+		double total_rows = (double)s.updates * ((s.size + 15) / 16);
+		printf("%-32s %6u %10llu %10llu %11.1f%% %11.1f%%\n", s.name.empty() ? id : s.name.c_str(), s.size, (unsigned long long)s.updates, (unsigned long long)s.unchanged, 100.0 * s.bytes_changed / total, 100.0 * s.rows_changed / total_rows);
+	}
+	free(stream_buffer);
+	free(ring.data);
+	munmap(mapped, st.st_size);
+	close(fd);
+	return 0;
+}
@@ -630,6 +630,174 @@ typedef hlsl_varray<hlsl_double, 4, 4> hlsl_double4x4;
 #define hlsl_bool4x4_cb_array(s) hlsl_marray_cb<hlsl_bool, 4, 4, s>
 
 
+// Compile time layout engine, for structs that never pass through cbuffergen.py.
+// Computes the same offsets, padding and size as the generator, and stores the members in a packed byte array:
+//
+//		typedef hlsl_layout<hlsl_lvec<hlsl_float, 4>, hlsl_lvec<hlsl_uint>, hlsl_lmat<hlsl_float, 4, 4>, hlsl_larray<hlsl_lvec<hlsl_float, 2>, 3>> DrawConstants;
+//		enum { Color, Flags, World, Offsets };
+//		DrawConstants cb;
+//		cb.get<Color>() = color;
+//		cb.get<World>()[2] = row;
+//		static_assert(DrawConstants::offset(World) == 32, "");
+//
+// Nested layouts are members too, and are 16 byte aligned like generated structs.
+
+template<typename T, size_t LEN = 1>
+struct hlsl_lvec;
+template<typename M, size_t COUNT>
+struct hlsl_larray;
+template<typename T, size_t LEN, size_t ROWS>
+using hlsl_lmat = hlsl_larray<hlsl_lvec<T, LEN>, ROWS>; // ROWS registers of LEN elements, same as a vector array
+template<typename... MEMBERS>
+struct hlsl_layout;
+template<typename M>
+struct hlsl_layout_member;
+
+constexpr size_t hlsl_layout_align(size_t offset, size_t align)
+{
+	return align * ((offset + align - 1) / align);
+}
+
+// same rules as CBufferGen.LayoutStruct
+constexpr size_t hlsl_layout_place(size_t offset, size_t size, size_t align)
+{
+	return align == 16 ? hlsl_layout_align(offset, 16) :
+		(offset % 16) + size > 16 ? hlsl_layout_align(offset, 16) :
+		align == 8 ? hlsl_layout_align(offset, 8) :
+		offset;
+}
+
+template<typename C, typename T>
+struct hlsl_layout_qualify
+{
+	typedef T TYPE;
+};
+template<typename T>
+struct hlsl_layout_qualify<const char, T>
+{
+	typedef const T TYPE;
+};
+
+template<size_t I, typename M, typename... REST>
+struct hlsl_layout_type_at
+{
+	typedef typename hlsl_layout_type_at<I - 1, REST...>::TYPE TYPE;
+};
+template<typename M, typename... REST>
+struct hlsl_layout_type_at<0, M, REST...>
+{
+	typedef M TYPE;
+};
+
+template<typename T, size_t LEN>
+struct hlsl_layout_member<hlsl_lvec<T, LEN>>
+{
+	static_assert(sizeof(T) == 2 || sizeof(T) % 4 == 0, "only 2 byte or dword sized elements supported");
+	static_assert(LEN >= 1 && LEN <= 4, "vectors have 1 to 4 elements");
+	typedef typename hlsl_layout_type_at<LEN == 1 ? 0 : 1, T, hlsl_vector_type<T, LEN>>::TYPE VALUE;
+	static const size_t SIZE = sizeof(T) * LEN;
+	static const size_t ALIGN = sizeof(T);
+	template<typename C>
+	static typename hlsl_layout_qualify<C, VALUE>::TYPE& get(C* ptr)
+	{
+		return *(typename hlsl_layout_qualify<C, VALUE>::TYPE*)ptr;
+	}
+};
+
+template<typename M, size_t COUNT, typename C>
+struct hlsl_larray_ref
+{
+	static const size_t STRIDE = hlsl_layout_align(hlsl_layout_member<M>::SIZE, 16);
+	C* ptr;
+	decltype(auto) operator[](size_t index) const
+	{
+		HLSL_ASSERT(index < COUNT);
+		return hlsl_layout_member<M>::get(ptr + index * STRIDE);
+	}
+};
+
+template<typename M, size_t COUNT>
+struct hlsl_layout_member<hlsl_larray<M, COUNT>>
+{
+	static_assert(COUNT > 0, "");
+	static const size_t SIZE = (COUNT - 1) * hlsl_layout_align(hlsl_layout_member<M>::SIZE, 16) + hlsl_layout_member<M>::SIZE;
+	static const size_t ALIGN = 16;
+	template<typename C>
+	static hlsl_larray_ref<M, COUNT, C> get(C* ptr)
+	{
+		return hlsl_larray_ref<M, COUNT, C>{ptr};
+	}
+};
+
+template<typename... MEMBERS>
+struct hlsl_layout_member<hlsl_layout<MEMBERS...>>
+{
+	static const size_t SIZE = hlsl_layout<MEMBERS...>::SIZE;
+	static const size_t ALIGN = 16;
+	template<typename C>
+	static typename hlsl_layout_qualify<C, hlsl_layout<MEMBERS...>>::TYPE& get(C* ptr)
+	{
+		return *(typename hlsl_layout_qualify<C, hlsl_layout<MEMBERS...>>::TYPE*)ptr;
+	}
+};
+
+template<typename... MEMBERS>
+struct hlsl_layout_offsets
+{
+	size_t offset[sizeof...(MEMBERS) + 1]; // last entry is the struct size
+	size_t padding;
+};
+
+template<typename... MEMBERS>
+constexpr hlsl_layout_offsets<MEMBERS...> hlsl_layout_calc()
+{
+	const size_t sizes[] = { 0, hlsl_layout_member<MEMBERS>::SIZE... };
+	const size_t aligns[] = { 0, hlsl_layout_member<MEMBERS>::ALIGN... };
+	hlsl_layout_offsets<MEMBERS...> o = {};
+	size_t offset = 0;
+	size_t used = 0;
+	for(size_t i = 0; i < sizeof...(MEMBERS); ++i)
+	{
+		offset = hlsl_layout_place(offset, sizes[i + 1], aligns[i + 1]);
+		o.offset[i] = offset;
+		offset += sizes[i + 1];
+		used += sizes[i + 1];
+	}
+	o.offset[sizeof...(MEMBERS)] = offset;
+	o.padding = offset - used;
+	return o;
+}
+
+template<typename... MEMBERS>
+struct alignas(16) hlsl_layout
+{
+	static const size_t NUM_MEMBERS = sizeof...(MEMBERS);
+	static constexpr hlsl_layout_offsets<MEMBERS...> OFFSETS = hlsl_layout_calc<MEMBERS...>();
+	static const size_t SIZE = OFFSETS.offset[NUM_MEMBERS];		// size in the constant buffer, sizeof rounds this up to 16 like a cbuffer slot
+	static const size_t PADDING = OFFSETS.padding;
+
+	static constexpr size_t offset(size_t index)
+	{
+		return OFFSETS.offset[index];
+	}
+
+	template<size_t I>
+	decltype(auto) get()
+	{
+		static_assert(I < NUM_MEMBERS, "member index out of range");
+		return hlsl_layout_member<typename hlsl_layout_type_at<I, MEMBERS...>::TYPE>::get(&data[OFFSETS.offset[I]]);
+	}
+	template<size_t I>
+	decltype(auto) get() const
+	{
+		static_assert(I < NUM_MEMBERS, "member index out of range");
+		return hlsl_layout_member<typename hlsl_layout_type_at<I, MEMBERS...>::TYPE>::get(&data[OFFSETS.offset[I]]);
+	}
+
+	char data[SIZE > 0 ? SIZE : 1];
+};
+
+
 
 
 
@@ -752,6 +920,21 @@ static_assert(sizeof(hlsl_float2x4_cb) == sizeof(float) * 2 + HLSL_ALIGN_16(size
 static_assert(sizeof(hlsl_float3x4_cb) == sizeof(float) * 3 + HLSL_ALIGN_16(sizeof(float)*3) * 3, "");
 static_assert(sizeof(hlsl_float4x4_cb) == sizeof(float) * 4 + HLSL_ALIGN_16(sizeof(float)*4) * 3, "");
 
+// layout engine, offsets as generated by cbuffergen.py
+typedef hlsl_layout<hlsl_lvec<hlsl_float, 4>, hlsl_lvec<hlsl_uint>> hlsl_verify_inner;
+typedef hlsl_layout<hlsl_lvec<hlsl_float>, hlsl_lvec<hlsl_float, 2>, hlsl_lvec<hlsl_bool>, hlsl_lvec<hlsl_uint16_t>, hlsl_lvec<hlsl_uint16_t>, hlsl_lvec<hlsl_double>,
+	hlsl_lmat<hlsl_float, 3, 4>, hlsl_larray<hlsl_lvec<hlsl_float, 2>, 3>, hlsl_verify_inner, hlsl_larray<hlsl_verify_inner, 2>, hlsl_lvec<hlsl_uint>,
+	hlsl_larray<hlsl_lmat<hlsl_float, 4, 4>, 2>> hlsl_verify_outer;
+static_assert(hlsl_verify_inner::SIZE == 20, "");
+static_assert(hlsl_verify_outer::offset(1) == 4 && hlsl_verify_outer::offset(2) == 12 && hlsl_verify_outer::offset(3) == 16 && hlsl_verify_outer::offset(4) == 18, "");
+static_assert(hlsl_verify_outer::offset(5) == 24 && hlsl_verify_outer::offset(6) == 32 && hlsl_verify_outer::offset(7) == 96 && hlsl_verify_outer::offset(8) == 144, "");
+static_assert(hlsl_verify_outer::offset(9) == 176 && hlsl_verify_outer::offset(10) == 228 && hlsl_verify_outer::offset(11) == 240, "");
+static_assert(hlsl_verify_outer::SIZE == 368 && hlsl_verify_outer::PADDING == 36, "");
+// double3 arrays and double4x2 rows are 32 bytes apart
+typedef hlsl_layout<hlsl_lvec<hlsl_float>, hlsl_larray<hlsl_lvec<hlsl_double, 3>, 2>, hlsl_lmat<hlsl_double, 4, 2>, hlsl_lvec<hlsl_float>> hlsl_verify_double;
+static_assert(hlsl_verify_double::offset(1) == 16 && hlsl_verify_double::offset(2) == 80 && hlsl_verify_double::offset(3) == 144 && hlsl_verify_double::SIZE == 148, "");
+static_assert(alignof(hlsl_verify_double) == 16 && sizeof(hlsl_verify_double) == 160, "");
+
 
 
 